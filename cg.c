@@ -4,6 +4,7 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -12,8 +13,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #define EXECUTABLE "cg"
 
@@ -37,9 +45,14 @@
         ERROR_AND_EXIT("ERROR: Creating %s\n", X);\
     }\
 
+#define MKDIR_IF_MISSING_OR_PANIC(C, X)\
+    if (!exists(X)) {\
+        MKDIR_OR_PANIC(C, X);\
+    }
+
 /* -------------------------------------------------------------------------------------------- */
 static const char* root_gitignore = "\
-build/\n\
+build\n\
 ";
 
 static const char* root_cmakelists = "\
@@ -117,6 +130,7 @@ Suite* suite(void) {\n\
     tc_core = tcase_create(\"test\");\n\
 \n\
     tcase_add_test(tc_core, sample_test);\n\
+    suite_add_tcase(s, tc_core);\n\
     return s;\n\
 }\n\
 \n\
@@ -137,9 +151,14 @@ int main() {\n\
 
 static const char* test_cmakelists_gtest = "cmake_minimum_required(VERSION 3.10)\n\
 \n\
-project(test)\n\
+project(tests)\n\
 \n\
-add_subdirectory(googletest)\n\
+set(TEST_TIMEOUT 60 CACHE STRING \"Timeout of each test in seconds\")\n\
+set(TEST_SHARDS 0 CACHE STRING \"Register N gtest shards instead of one test per case, 0 to disable\")\n\
+\n\
+if (NOT TARGET gtest)\n\
+    add_subdirectory(googletest)\n\
+endif()\n\
 add_executable(${PROJECT_NAME}\n\
     test.cpp\n\
 )\n\
@@ -148,13 +167,33 @@ target_link_libraries(${PROJECT_NAME}\n\
     gtest\n\
     gtest_main\n\
 )\n\
+\n\
+if (TEST_SHARDS GREATER 0)\n\
+    math(EXPR LAST_SHARD \"${TEST_SHARDS} - 1\")\n\
+    foreach(SHARD RANGE ${LAST_SHARD})\n\
+        add_test(NAME ${PROJECT_NAME}.shard_${SHARD} COMMAND ${PROJECT_NAME})\n\
+        set_tests_properties(${PROJECT_NAME}.shard_${SHARD} PROPERTIES\n\
+            ENVIRONMENT \"GTEST_TOTAL_SHARDS=${TEST_SHARDS};GTEST_SHARD_INDEX=${SHARD}\"\n\
+            TIMEOUT ${TEST_TIMEOUT}\n\
+        )\n\
+    endforeach()\n\
+else()\n\
+    include(GoogleTest)\n\
+    gtest_discover_tests(${PROJECT_NAME}\n\
+        PROPERTIES TIMEOUT ${TEST_TIMEOUT}\n\
+    )\n\
+endif()\n\
 ";
 
 static const char* test_cmakelists_libcheck = "cmake_minimum_required(VERSION 3.10)\n\
 \n\
-project(test)\n\
+project(tests)\n\
 \n\
-add_subdirectory(check)\n\
+set(TEST_TIMEOUT 60 CACHE STRING \"Timeout of each test in seconds\")\n\
+\n\
+if (NOT TARGET check)\n\
+    add_subdirectory(check)\n\
+endif()\n\
 add_executable(${PROJECT_NAME}\n\
     test.c\n\
 )\n\
@@ -163,6 +202,18 @@ target_link_libraries(${PROJECT_NAME}\n\
     check\n\
     pthread\n\
 )\n\
+\n\
+# One test per tcase_create(\"NAME\") in test.c, run alone through CK_RUN_CASE\n\
+set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS test.c)\n\
+file(STRINGS test.c TCASES REGEX \"tcase_create\\\\(\\\"[^\\\"]+\\\"\\\\)\")\n\
+foreach(TCASE ${TCASES})\n\
+    string(REGEX REPLACE \".*tcase_create\\\\(\\\"([^\\\"]+)\\\"\\\\).*\" \"\\\\1\" TCASE \"${TCASE}\")\n\
+    add_test(NAME ${PROJECT_NAME}.${TCASE} COMMAND ${PROJECT_NAME})\n\
+    set_tests_properties(${PROJECT_NAME}.${TCASE} PROPERTIES\n\
+        ENVIRONMENT \"CK_RUN_CASE=${TCASE}\"\n\
+        TIMEOUT ${TEST_TIMEOUT}\n\
+    )\n\
+endforeach()\n\
 ";
 
 typedef struct {
@@ -196,6 +247,265 @@ static const char* benchmark_bench = "#include <benchmark/benchmark.h>\n\
 BENCHMARK_MAIN();\n\
 ";
 
+static const char* benchmark_cmakelists_bench_env = "\n\
+set(BENCH_CPUS \"\" CACHE STRING \"cpus bench_pinned runs bench on, e.g. 2,3 or 2-5, empty for the last online cpu\")\n\
+set(BENCH_POLICY \"other\" CACHE STRING \"scheduling policy of bench_pinned [other|batch|fifo|rr], fifo and rr need CAP_SYS_NICE\")\n\
+option(BENCH_ENV_STRICT \"fail bench_env_check and bench_pinned when the machine state is noisy\" OFF)\n\
+if (BENCH_ENV_STRICT)\n\
+    list(APPEND BENCH_ENV_FLAGS --strict)\n\
+endif()\n\
+if (BENCH_CPUS)\n\
+    list(APPEND BENCH_ENV_FLAGS --cpus ${BENCH_CPUS})\n\
+endif()\n\
+\n\
+add_executable(bench_env\n\
+    bench_env.cpp\n\
+)\n\
+\n\
+add_custom_target(bench_env_check\n\
+    COMMAND bench_env check ${BENCH_ENV_FLAGS}\n\
+    USES_TERMINAL\n\
+)\n\
+\n\
+add_custom_target(bench_pinned\n\
+    COMMAND bench_env run ${BENCH_ENV_FLAGS} --policy ${BENCH_POLICY} --no-aslr -- $<TARGET_FILE:bench>\n\
+    DEPENDS bench\n\
+    USES_TERMINAL\n\
+)\n\
+";
+
+static const char* benchmark_bench_env = "// Checks the machine state before benchmarking, reads /proc and /sys only\n\
+//\n\
+//   bench_env check [--strict] [--cpus LIST]\n\
+//   bench_env run   [--strict] [--cpus LIST] [--policy other|batch|fifo|rr] [--priority N] [--no-aslr] -- CMD...\n\
+//\n\
+// check exits 1 with --strict when the state is noisy, run pins CMD to LIST\n\
+// with the given scheduling policy (other by default) and executes it.\n\
+// LIST must only name online cpus and defaults to the last online cpu\n\
+\n\
+#include <sched.h>\n\
+#include <sys/personality.h>\n\
+#include <unistd.h>\n\
+\n\
+#include <cstdio>\n\
+#include <cstdlib>\n\
+#include <cstring>\n\
+#include <fstream>\n\
+#include <set>\n\
+#include <sstream>\n\
+#include <string>\n\
+\n\
+static int warnings = 0;\n\
+\n\
+static std::string read_first_line(const std::string& path) {\n\
+    std::ifstream in(path);\n\
+    std::string line;\n\
+    if (!in || !std::getline(in, line)) {\n\
+        return \"\";\n\
+    }\n\
+    return line;\n\
+}\n\
+\n\
+static std::set<int> parse_cpu_list(const std::string& list) {\n\
+    std::set<int> cpus;\n\
+    std::stringstream ss(list);\n\
+    std::string range;\n\
+    while (std::getline(ss, range, ',')) {\n\
+        if (range.empty()) {\n\
+            continue;\n\
+        }\n\
+        size_t dash = range.find('-');\n\
+        int first = std::atoi(range.c_str());\n\
+        int last = (dash == std::string::npos) ? first : std::atoi(range.c_str() + dash + 1);\n\
+        for (int cpu = first; cpu <= last; ++cpu) {\n\
+            cpus.insert(cpu);\n\
+        }\n\
+    }\n\
+    return cpus;\n\
+}\n\
+\n\
+static std::string cpu_path(int cpu, const char* file) {\n\
+    return \"/sys/devices/system/cpu/cpu\" + std::to_string(cpu) + \"/\" + file;\n\
+}\n\
+\n\
+static void report(bool noisy, const char* what, const std::string& value, const char* hint) {\n\
+    if (noisy) {\n\
+        ++warnings;\n\
+    }\n\
+    std::printf(\"%-5s %-20s %-16s %s\\n\", noisy ? \"WARN\" : \"ok\", what, value.empty() ? \"n/a\" : value.c_str(),\n\
+            noisy ? hint : \"\");\n\
+}\n\
+\n\
+static void check(const std::set<int>& cpus, bool no_aslr) {\n\
+    for (int cpu : cpus) {\n\
+        std::string governor = read_first_line(cpu_path(cpu, \"cpufreq/scaling_governor\"));\n\
+        std::string what = \"cpu\" + std::to_string(cpu) + \" governor\";\n\
+        report(!governor.empty() && governor != \"performance\", what.c_str(), governor,\n\
+                \"echo performance > /sys/devices/system/cpu/cpuN/cpufreq/scaling_governor\");\n\
+    }\n\
+\n\
+    std::string no_turbo = read_first_line(\"/sys/devices/system/cpu/intel_pstate/no_turbo\");\n\
+    std::string boost = read_first_line(\"/sys/devices/system/cpu/cpufreq/boost\");\n\
+    if (!no_turbo.empty()) {\n\
+        report(no_turbo == \"0\", \"turbo\", no_turbo == \"0\" ? \"on\" : \"off\",\n\
+                \"echo 1 > /sys/devices/system/cpu/intel_pstate/no_turbo\");\n\
+    } else {\n\
+        report(boost == \"1\", \"boost\", boost.empty() ? \"\" : (boost == \"1\" ? \"on\" : \"off\"),\n\
+                \"echo 0 > /sys/devices/system/cpu/cpufreq/boost\");\n\
+    }\n\
+\n\
+    report(read_first_line(\"/sys/devices/system/cpu/smt/active\") == \"1\", \"smt\",\n\
+            read_first_line(\"/sys/devices/system/cpu/smt/control\"),\n\
+            \"siblings share a core, pin to one thread per core or echo off > /sys/devices/system/cpu/smt/control\");\n\
+\n\
+    for (int cpu : cpus) {\n\
+        std::string siblings = read_first_line(cpu_path(cpu, \"topology/thread_siblings_list\"));\n\
+        std::set<int> sibling_cpus = parse_cpu_list(siblings);\n\
+        bool shared = false;\n\
+        for (int sibling : sibling_cpus) {\n\
+            shared |= sibling != cpu && read_first_line(cpu_path(sibling, \"online\")) != \"0\";\n\
+        }\n\
+        std::string what = \"cpu\" + std::to_string(cpu) + \" siblings\";\n\
+        report(shared, what.c_str(), siblings, \"an online sibling thread shares the core\");\n\
+    }\n\
+\n\
+    std::string isolated = read_first_line(\"/sys/devices/system/cpu/isolated\");\n\
+    std::set<int> isolated_cpus = parse_cpu_list(isolated);\n\
+    bool all_isolated = !isolated_cpus.empty();\n\
+    for (int cpu : cpus) {\n\
+        all_isolated &= isolated_cpus.count(cpu) > 0;\n\
+    }\n\
+    report(!all_isolated, \"isolated cpus\", isolated, \"boot with isolcpus= / nohz_full= for the benchmark cpus\");\n\
+\n\
+    std::string loadavg = read_first_line(\"/proc/loadavg\");\n\
+    double load = std::atof(loadavg.c_str());\n\
+    report(load > 1.0, \"load average\", loadavg.substr(0, loadavg.find(' ')), \"machine is busy\");\n\
+\n\
+    std::string aslr = read_first_line(\"/proc/sys/kernel/randomize_va_space\");\n\
+    if (no_aslr) {\n\
+        report(false, \"aslr\", \"off (--no-aslr)\", \"\");\n\
+    } else {\n\
+        report(aslr != \"0\", \"aslr\", aslr, \"use run --no-aslr or echo 0 > /proc/sys/kernel/randomize_va_space\");\n\
+    }\n\
+}\n\
+\n\
+static int policy_from_string(const char* policy) {\n\
+    if (std::strcmp(policy, \"other\") == 0) return SCHED_OTHER;\n\
+    if (std::strcmp(policy, \"batch\") == 0) return SCHED_BATCH;\n\
+    if (std::strcmp(policy, \"fifo\") == 0) return SCHED_FIFO;\n\
+    if (std::strcmp(policy, \"rr\") == 0) return SCHED_RR;\n\
+    return -1;\n\
+}\n\
+\n\
+static int usage(const char* exec) {\n\
+    std::fprintf(stderr, \"Usage: %s check [--strict] [--cpus LIST]\\n\"\n\
+            \"       %s run [--strict] [--cpus LIST] [--policy other|batch|fifo|rr] [--priority N] [--no-aslr] -- CMD...\\n\",\n\
+            exec, exec);\n\
+    return 2;\n\
+}\n\
+\n\
+int main(int argc, char** argv) {\n\
+    if (argc < 2) {\n\
+        return usage(argv[0]);\n\
+    }\n\
+\n\
+    bool run = std::strcmp(argv[1], \"run\") == 0;\n\
+    if (!run && std::strcmp(argv[1], \"check\") != 0) {\n\
+        return usage(argv[0]);\n\
+    }\n\
+\n\
+    bool strict = false;\n\
+    bool no_aslr = false;\n\
+    int policy = SCHED_OTHER;\n\
+    int priority = 0;\n\
+    std::string online_list = read_first_line(\"/sys/devices/system/cpu/online\");\n\
+    std::set<int> online = parse_cpu_list(online_list);\n\
+    std::string cpu_list = online.empty() ? \"0\" : std::to_string(*online.rbegin());\n\
+    char** command = nullptr;\n\
+\n\
+    for (int i = 2; i < argc; ++i) {\n\
+        if (std::strcmp(argv[i], \"--strict\") == 0) {\n\
+            strict = true;\n\
+        } else if (std::strcmp(argv[i], \"--no-aslr\") == 0) {\n\
+            no_aslr = true;\n\
+        } else if (std::strcmp(argv[i], \"--cpus\") == 0 && i + 1 < argc) {\n\
+            cpu_list = argv[++i];\n\
+        } else if (std::strcmp(argv[i], \"--policy\") == 0 && i + 1 < argc) {\n\
+            policy = policy_from_string(argv[++i]);\n\
+            if (policy < 0) {\n\
+                return usage(argv[0]);\n\
+            }\n\
+        } else if (std::strcmp(argv[i], \"--priority\") == 0 && i + 1 < argc) {\n\
+            priority = std::atoi(argv[++i]);\n\
+        } else if (std::strcmp(argv[i], \"--\") == 0 && run && i + 1 < argc) {\n\
+            command = argv + i + 1;\n\
+            break;\n\
+        } else {\n\
+            return usage(argv[0]);\n\
+        }\n\
+    }\n\
+\n\
+    if (run && command == nullptr) {\n\
+        return usage(argv[0]);\n\
+    }\n\
+\n\
+    std::set<int> cpus = parse_cpu_list(cpu_list);\n\
+    if (cpus.empty()) {\n\
+        std::fprintf(stderr, \"bench_env: no cpus in '%s'\\n\", cpu_list.c_str());\n\
+        return 2;\n\
+    }\n\
+\n\
+    for (int cpu : cpus) {\n\
+        if (!online.empty() && online.count(cpu) == 0) {\n\
+            std::fprintf(stderr, \"bench_env: cpu%d is missing or offline, online cpus are %s\\n\", cpu,\n\
+                    online_list.c_str());\n\
+            return 2;\n\
+        }\n\
+    }\n\
+\n\
+    check(cpus, run && no_aslr);\n\
+    if (warnings > 0) {\n\
+        std::fprintf(stderr, \"bench_env: %d warning(s), results may be noisy\\n\", warnings);\n\
+        if (strict) {\n\
+            return 1;\n\
+        }\n\
+    }\n\
+\n\
+    if (!run) {\n\
+        return 0;\n\
+    }\n\
+\n\
+    cpu_set_t set;\n\
+    CPU_ZERO(&set);\n\
+    for (int cpu : cpus) {\n\
+        CPU_SET(cpu, &set);\n\
+    }\n\
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {\n\
+        std::perror(\"bench_env: sched_setaffinity\");\n\
+        return 1;\n\
+    }\n\
+\n\
+    sched_param param{};\n\
+    param.sched_priority = (policy == SCHED_FIFO || policy == SCHED_RR)\n\
+        ? (priority > 0 ? priority : sched_get_priority_min(policy))\n\
+        : 0;\n\
+    if (sched_setscheduler(0, policy, &param) < 0) {\n\
+        std::perror(\"bench_env: sched_setscheduler, needs CAP_SYS_NICE for fifo/rr, try --policy other\");\n\
+        return 1;\n\
+    }\n\
+\n\
+    if (no_aslr && personality(personality(0xffffffff) | ADDR_NO_RANDOMIZE) < 0) {\n\
+        std::perror(\"bench_env: personality\");\n\
+        return 1;\n\
+    }\n\
+\n\
+    std::fflush(stdout);\n\
+    execvp(command[0], command);\n\
+    std::perror(\"bench_env: execvp\");\n\
+    return 127;\n\
+}\n\
+";
+
 typedef struct {
     const char* bench;
     const char* cmakelists;
@@ -217,6 +527,67 @@ EXEC: main.c\n\
 		$(CC) $(CFLAGS) main.c -o $(EXEC)";
 
 
+/* -------------------------------------------------------------------------------------------- */
+static bool exists(const char* dir) {
+    struct stat _stat;
+    return stat(dir, &_stat) == 0 && S_ISDIR(_stat.st_mode);
+}
+
+static bool file_exists(const char* file) {
+    struct stat _stat;
+    return stat(file, &_stat) == 0 && S_ISREG(_stat.st_mode);
+}
+
+__attribute__((malloc)) static char* read_file(const char* file, size_t* size) {
+    FILE* fp = fopen(file, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    size_t capacity = 1024;
+    size_t len = 0;
+    char* content = (char*) malloc(capacity);
+
+    size_t n;
+    while ((n = fread(content + len, 1, capacity - len - 1, fp)) > 0) {
+        len += n;
+        if (len + 1 == capacity) {
+            capacity *= 2;
+            content = realloc(content, capacity);
+        }
+    }
+    content[len] = '\0';
+
+    fclose(fp);
+    *size = len;
+    return content;
+}
+
+__attribute__((malloc)) static char* read_fd(int fd, size_t* size) {
+    size_t capacity = 1024;
+    size_t len = 0;
+    char* content = (char*) malloc(capacity);
+
+    lseek(fd, 0, SEEK_SET);
+
+    ssize_t n;
+    while ((n = read(fd, content + len, capacity - len - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        len += n;
+        if (len + 1 == capacity) {
+            capacity *= 2;
+            content = realloc(content, capacity);
+        }
+    }
+    content[len] = '\0';
+
+    *size = len;
+    return content;
+}
+
 /* -------------------------------------------------------------------------------------------- */
 #define REPOSITORY_GOOGLE_TEST "https://github.com/google/googletest"
 #define REPOSITORY_GOOGLE_BENCHMARK "https://github.com/google/benchmark.git"
@@ -250,6 +621,19 @@ EXEC: main.c\n\
     }
 
 static void CG_ADD_SUBMODULE(const char* dir, const char* repo) {
+    const char* name = strrchr(repo, '/') + 1;
+    size_t name_size = strlen(name);
+    if (name_size > 4 && STRCMP(name + name_size - 4, ".git")) {
+        name_size -= 4;
+    }
+
+    size_t submodule_size = strlen(dir) + name_size + 2;
+    char submodule[submodule_size];
+    snprintf(submodule, submodule_size, "%s/%.*s", dir, (int) name_size, name);
+    if (exists(submodule)) {   /* Already vendored, keep the checkout as is */
+        return;
+    }
+
     size_t buffer_size = strlen(GIT_SUBMODULE_ADD) + strlen(repo) + 3;
     char buffer[buffer_size];
     snprintf(buffer, buffer_size, "%s %s\0", GIT_SUBMODULE_ADD, repo);
@@ -261,8 +645,13 @@ static void CG_ADD_SUBMODULE(const char* dir, const char* repo) {
 typedef struct {
     bool init;
     bool new;
+    bool add;
 } Args;
 
+static void mk_args(Args* args) {
+    *args = (Args) { 0 };
+}
+
 #define IS_ADD_SUPPLIED (flags.test || flags.benchmark)
 
 typedef struct {
@@ -272,22 +661,51 @@ typedef struct {
          initialize_git_repo,
          sprinkle_w_numerics,
          add_libcheck,
-         make_c_files;
+         make_c_files,
+         preconfigure,
+         bench_env,
+         scratch;
 } Flags;
 
 static void mk_flags(Flags* flags) {
-    flags->initialize_git_repo = true;
+    *flags = (Flags) {
+        .initialize_git_repo = true,
+    };
 }
 
-/* -------------------------------------------------------------------------------------------- */
-static int exists(const char* dir) {
-    struct stat _stat;
-    if (stat(&dir, &stat) == 0 && S_ISDIR(_stat.st_mode)) {
-        return 0;
+static void Usage(FILE* where);
+
+static char** parse_add_list(char** curr, char** args_end, Flags* flags) {
+    size_t max_args_len = 2;
+    char** list_args_begin = curr;
+    char** list_args_end = (curr + 1 != args_end) ? (list_args_begin + max_args_len) : (args_end);
+
+    if (*list_args_begin[0] != '+') { /* Check first arg */
+        ERROR("ERROR: Invaild %s\n", *list_args_begin);
+        Usage(stderr);
+        exit(1);
     }
-    return -1;
+
+    while(list_args_begin != list_args_end) {
+        if (*list_args_begin[0] != '+') {
+            break;
+        }
+
+        if (STRCMP(*list_args_begin, "+test")) {
+            flags->test = true;
+        } else if (STRCMP(*list_args_begin, "+bench")) {
+            flags->benchmark = true;
+        } else {
+            ERROR("ERROR: Invaild %s\n", *list_args_begin);
+            Usage(stderr);
+            exit(1);
+        }
+        list_args_begin++;
+    }
+    return list_args_begin;
 }
 
+/* -------------------------------------------------------------------------------------------- */
 __attribute__ ((const)) static const char* get_curr_path(void) {
     char* curr_path = getenv("PWD");
     if (curr_path == NULL) {
@@ -297,11 +715,11 @@ __attribute__ ((const)) static const char* get_curr_path(void) {
     return curr_path;
 }
 
-__attribute__ ((pure, malloc)) static char* get_curr_folder(char* path, size_t path_size) {
-    char* start = NULL;
-    char* end = path + path_size;
+__attribute__ ((pure, malloc)) static char* get_curr_folder(const char* path, size_t path_size) {
+    const char* start = NULL;
+    const char* end = path + path_size;
 
-    char* cursor = end;
+    const char* cursor = end;
 
 LOOP:
     if (*cursor == '/') {
@@ -365,6 +783,7 @@ static bool is_vaild_string_of_ints(char* str, size_t len) {
 typedef enum {
     cg_file_write,
     cg_file_append,
+    cg_file_create,   /* write only if the file is missing */
 } cg_file_type;
 
 static const char* __attribute__((always_inline)) cg_file_type_to_string(cg_file_type type) {
@@ -374,15 +793,33 @@ static const char* __attribute__((always_inline)) cg_file_type_to_string(cg_file
     switch (type) {
         _FILE_TYPE_TO_STRING(cg_file_write, "w");
         _FILE_TYPE_TO_STRING(cg_file_append, "a");
+        _FILE_TYPE_TO_STRING(cg_file_create, "w");
     }
     return "???";
 }
 
 #define WRITE(X, Y, Z) CG_WRITE(cg_file_write, X, Y, Z)
 #define WRITE_APPEND(X, Y, Z) CG_WRITE(cg_file_append, X, Y, Z)
+#define WRITE_CREATE(X, Y, Z) CG_WRITE(cg_file_create, X, Y, Z)
 static void CG_WRITE(cg_file_type type, const char* directory_path, const char* file_path, char* content, ...) {
     char* _file = append_path(directory_path, file_path);
 
+    if (type == cg_file_create && file_exists(_file)) {
+        free(_file);
+        return;
+    }
+
+    va_list args;
+
+    va_start(args, content);
+    int buffer_size = vsnprintf(NULL, 0, content, args) + 1;
+    va_end(args);
+
+    char* buffer = (char*) malloc(buffer_size);
+    va_start(args, content);
+    vsnprintf(buffer, buffer_size, content, args);
+    va_end(args);
+
     const char* mode = cg_file_type_to_string(type);
     FILE* fp = fopen(_file, mode);
     if (fp == NULL) {
@@ -390,16 +827,83 @@ static void CG_WRITE(cg_file_type type, const char* directory_path, const char*
         exit(1);
     }
 
-    va_list args;
-
-    va_start(args, content);
-    vfprintf(fp, content, args);
-    va_end(args);
+    fwrite(buffer, 1, buffer_size - 1, fp);
 
+    free(buffer);
     free(_file);
     fclose(fp);
 }
 
+/*
+ * Returns where LINE starts in CONTENT when it is on a line of its own, NULL otherwise
+ */
+static char* find_line(char* content, const char* line) {
+    size_t line_size = strlen(line);
+
+    char* cursor = content;
+    while ((cursor = strstr(cursor, line)) != NULL) {
+        char after = cursor[line_size];
+        if ((cursor == content || cursor[-1] == '\n') && (after == '\n' || after == '\0')) {
+            return cursor;
+        }
+        cursor += line_size;
+    }
+    return NULL;
+}
+
+/*
+ * Appends TEXT to DIRECTORY_PATH/CMakeLists.txt unless the file already has LINE on a line of its own
+ */
+static void cmake_append_once(const char* directory_path, const char* line, const char* text) {
+    char* _file = append_path(directory_path, "CMakeLists.txt");
+
+    size_t size;
+    char* content = read_file(_file, &size);
+    free(_file);
+
+    if (content != NULL && find_line(content, line) != NULL) {
+        free(content);
+        return;
+    }
+
+    bool needs_newline = content != NULL && size > 0 && content[size - 1] != '\n';
+    free(content);
+
+    CG_WRITE(cg_file_append, directory_path, "CMakeLists.txt", needs_newline ? "\n%s" : "%s", text);
+}
+
+/*
+ * Like cmake_append_once, but TEXT goes right before the line BEFORE when the file has it
+ */
+static void cmake_insert_once(const char* directory_path, const char* line, const char* before, const char* text) {
+    char* _file = append_path(directory_path, "CMakeLists.txt");
+
+    size_t size;
+    char* content = read_file(_file, &size);
+    free(_file);
+
+    char* position = (content != NULL && find_line(content, line) == NULL) ? find_line(content, before) : NULL;
+    if (position == NULL) {
+        free(content);
+        cmake_append_once(directory_path, line, text);
+        return;
+    }
+
+    CG_WRITE(cg_file_write, directory_path, "CMakeLists.txt", "%.*s%s%s", (int) (position - content), content,
+            text, position);
+    free(content);
+}
+
+static void cmake_add_subdirectory(const char* directory_path, const char* subdirectory) {
+    size_t line_size = strlen("add_subdirectory()\n") + strlen(subdirectory) + 1;
+    char text[line_size];
+    snprintf(text, line_size, "add_subdirectory(%s)\n", subdirectory);
+
+    char line[line_size];
+    snprintf(line, line_size - 1, "%s", text);   /* drop the newline */
+    cmake_append_once(directory_path, line, text);
+}
+
 /* -------------------------------------------------------------------------------------------- */
 static const char* alphas = "abcdefghigklmopqrstuvxyz";
 static const char* numerics = "0123456789";
@@ -464,14 +968,15 @@ static void mk_config_name_new(Config* config, char* curr) {
 }
 
 static void mk_config_name_init(Config* config) {
-    config->name = get_curr_folder(config->path, strlen(config->path));
+    const char* current_path = get_curr_path();
+    config->name = get_curr_folder(current_path, strlen(current_path));
 }
 
 static void mk_path(Config* config, Args args) {
     char* current_path = get_curr_path();
 
-    if (args.init) {
-        config->path = current_path;
+    if (args.init || args.add) {
+        config->path = strdup(current_path);
     }
 
     if (args.new) {
@@ -479,6 +984,540 @@ static void mk_path(Config* config, Args args) {
     }
 }
 
+/* -------------------------------------------------------------------------------------------- */
+#define PRECONFIGURE_BUILD_DIR "build"
+#define PRECONFIGURE_STATUS "cg-preconfigure.status"
+#define PRECONFIGURE_STATUS_TMP "cg-preconfigure.status.tmp"
+#define PRECONFIGURE_LOG "cg-preconfigure.log"
+
+#define CMAKE_CONFIGURE "cmake -S '%s' -B '%s' -DCMAKE_EXPORT_COMPILE_COMMANDS=ON"
+#define CMAKE_BUILD_TARGETS "cmake --build '%s' --target %s"
+
+/*
+ * Written to a temporary file and renamed into place, so cg status never reads a truncated status
+ */
+static void preconfigure_status(const char* directory_build, pid_t pid, const char* state, const char* step) {
+    CG_WRITE(cg_file_write, directory_build, PRECONFIGURE_STATUS_TMP, "state: %s\npid: %ld\nstep: %s\n",
+            state, (long) pid, step);
+
+    char* status_tmp = append_path(directory_build, PRECONFIGURE_STATUS_TMP);
+    char* status = append_path(directory_build, PRECONFIGURE_STATUS);
+    if (rename(status_tmp, status) < 0) {
+        ERROR("ERROR: rename(): %s: ", status);
+        perror(NULL);
+    }
+    free(status_tmp);
+    free(status);
+}
+
+static bool preconfigure_exec(const char* directory_build, const char* step, const char* command) {
+    preconfigure_status(directory_build, getpid(), "running", step);
+    fprintf(stdout, "cg: %s: %s\n", step, command);
+    fflush(stdout);
+
+    int status = system(command);
+    if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        preconfigure_status(directory_build, getpid(), "failed", step);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Forks a detached job which configures PATH/build and builds the dependency TARGETS (may be NULL)
+ * at the lowest priority, progress goes to build/cg-preconfigure.{status,log}
+ */
+static void preconfigure(Config* config, const char* targets) {
+    char* directory_build = append_path(config->path, PRECONFIGURE_BUILD_DIR);
+    MKDIR_IF_MISSING_OR_PANIC(config, directory_build);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    /* The job waits for the pipe to close, so the status written here is never newer than its own */
+    int started[2];
+    if (pipe(started) < 0) {
+        perror("pipe");
+        free(directory_build);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(started[0]);
+        close(started[1]);
+        free(directory_build);
+        return;
+    }
+
+    if (pid > 0) {
+        close(started[0]);
+        preconfigure_status(directory_build, pid, "running", "queued");
+        close(started[1]);
+
+        fprintf(stdout, "cg: Preconfiguring %s in background (pid %ld), check with `%s status`\n",
+                config->directory, (long) pid, EXECUTABLE);
+        free(directory_build);
+        return;
+    }
+
+    close(started[1]);
+    char byte;
+    while (read(started[0], &byte, 1) < 0 && errno == EINTR);
+    close(started[0]);
+
+    setsid();
+    if (nice(19) < 0) {
+        perror("nice");
+    }
+
+    char* log = append_path(directory_build, PRECONFIGURE_LOG);
+    int log_fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    int null_fd = open("/dev/null", O_RDONLY);
+    free(log);
+    if (log_fd < 0 || null_fd < 0) {
+        _exit(1);
+    }
+    dup2(null_fd, STDIN_FILENO);
+    dup2(log_fd, STDOUT_FILENO);
+    dup2(log_fd, STDERR_FILENO);
+    close(null_fd);
+    close(log_fd);
+
+    const char* generator = (system("command -v ninja > /dev/null 2>&1") == 0) ? " -G Ninja" : "";
+
+    size_t command_size = strlen(CMAKE_CONFIGURE) + strlen(config->path) + strlen(directory_build)
+        + strlen(generator) + 1;
+    char configure[command_size];
+    snprintf(configure, command_size, CMAKE_CONFIGURE "%s", config->path, directory_build, generator);
+
+    if (!preconfigure_exec(directory_build, "configure", configure)) {
+        _exit(1);
+    }
+
+    if (targets != NULL) {
+        command_size = strlen(CMAKE_BUILD_TARGETS) + strlen(directory_build) + strlen(targets) + 1;
+        char build[command_size];
+        snprintf(build, command_size, CMAKE_BUILD_TARGETS, directory_build, targets);
+
+        if (!preconfigure_exec(directory_build, "build dependencies", build)) {
+            _exit(1);
+        }
+    }
+
+    preconfigure_status(directory_build, getpid(), "done", targets != NULL ? "build dependencies" : "configure");
+    _exit(0);
+}
+
+/*
+ * Prints the state of the preconfigure job of the project in DIRECTORY, returns the exit code
+ */
+static int preconfigure_report(const char* directory) {
+    char* directory_build = append_path(directory, PRECONFIGURE_BUILD_DIR);
+    char* status_file = append_path(directory_build, PRECONFIGURE_STATUS);
+    char* log = append_path(directory_build, PRECONFIGURE_LOG);
+    free(directory_build);
+
+    size_t size;
+    char* status = read_file(status_file, &size);
+    if (status == NULL) {
+        ERROR("ERROR: No preconfigure job found in %s\n", directory);
+        free(status_file);
+        free(log);
+        return 1;
+    }
+
+    int exit_code = 0;
+    long pid = 0;
+    char* cursor = strstr(status, "pid: ");
+    if (cursor != NULL) {
+        pid = strtol(cursor + strlen("pid: "), NULL, 10);
+    }
+
+    if (strstr(status, "state: running") != NULL) {
+        if (pid > 0 && kill((pid_t) pid, 0) < 0 && errno == ESRCH) {
+            fprintf(stdout, "state: died\n%s", strstr(status, "pid: "));
+            exit_code = 1;
+        } else {
+            fprintf(stdout, "%s", status);
+            exit_code = 2;
+        }
+    } else {
+        fprintf(stdout, "%s", status);
+        exit_code = (strstr(status, "state: done") != NULL) ? 0 : 1;
+    }
+    fprintf(stdout, "log: %s\n", log);
+
+    free(status);
+    free(status_file);
+    free(log);
+    return exit_code;
+}
+
+/* -------------------------------------------------------------------------------------------- */
+#define SCRATCH_DIR_ENV "CG_SCRATCH_DIR"
+#define SCRATCH_DIR_RUNTIME "%s/cg"
+#define SCRATCH_DIR_DEFAULT "/dev/shm/cg-%ld"
+#define SCRATCH_REGISTRY "registry"
+#define SCRATCH_GC_DEFAULT_AGE "7d"
+
+static char scratch_root[4096];
+
+/*
+ * $CG_SCRATCH_DIR, else $XDG_RUNTIME_DIR/cg, else /dev/shm/cg-UID, always a per-user dir by default
+ */
+static const char* get_scratch_root(void) {
+    if (scratch_root[0] != '\0') {
+        return scratch_root;
+    }
+
+    const char* configured = getenv(SCRATCH_DIR_ENV);
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (configured != NULL && configured[0] != '\0') {
+        snprintf(scratch_root, sizeof(scratch_root), "%s", configured);
+    } else if (runtime != NULL && runtime[0] != '\0') {
+        snprintf(scratch_root, sizeof(scratch_root), SCRATCH_DIR_RUNTIME, runtime);
+    } else {
+        snprintf(scratch_root, sizeof(scratch_root), SCRATCH_DIR_DEFAULT, (long) getuid());
+    }
+    return scratch_root;
+}
+
+/*
+ * Refuses a scratch root another user could have planted or can write to, gc deletes what its
+ * registry lists. Creates the root when CREATE, returns false when it is missing otherwise
+ */
+static bool check_scratch_root(bool create) {
+    const char* root = get_scratch_root();
+
+    struct stat _stat;
+    if (lstat(root, &_stat) < 0) {
+        if (errno != ENOENT) {
+            ERROR("ERROR: lstat(): %s: ", root);
+            perror(NULL);
+            exit(1);
+        }
+        if (!create) {
+            return false;
+        }
+        CG_MKDIR(root);
+        if (lstat(root, &_stat) < 0) {
+            ERROR("ERROR: lstat(): %s: ", root);
+            perror(NULL);
+            exit(1);
+        }
+    }
+
+    if (!S_ISDIR(_stat.st_mode) || _stat.st_uid != getuid() || (_stat.st_mode & (S_IWGRP | S_IWOTH))) {
+        ERROR("ERROR: Refusing scratch dir %s, it has to be a directory owned by you and not writable by others\n", root);
+        exit(1);
+    }
+    return true;
+}
+
+/*
+ * Opens the registry without following symlinks, -1 with errno set when it cannot be opened
+ */
+static int open_registry(int flags) {
+    char* registry = append_path(get_scratch_root(), SCRATCH_REGISTRY);
+    int fd = open(registry, flags | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        free(registry);
+        return -1;
+    }
+
+    struct stat _stat;
+    if (fstat(fd, &_stat) < 0 || !S_ISREG(_stat.st_mode) || _stat.st_uid != getuid()) {
+        ERROR("ERROR: Refusing registry %s, it has to be a regular file owned by you\n", registry);
+        exit(1);
+    }
+    free(registry);
+    return fd;
+}
+
+/*
+ * Only NAME.XXXXXX dirs right under the scratch root are ever removed by gc
+ */
+static bool is_scratch_target(const char* target) {
+    const char* root = get_scratch_root();
+    size_t root_size = strlen(root);
+
+    if (strncmp(target, root, root_size) != 0 || target[root_size] != '/') {
+        return false;
+    }
+
+    const char* name = target + root_size + 1;
+    return name[0] != '\0' && strchr(name, '/') == NULL && !STRCMP(name, ".") && !STRCMP(name, "..")
+        && !STRCMP(name, SCRATCH_REGISTRY);
+}
+
+/*
+ * Creates a unique NAME.XXXXXX dir under the scratch root (tmpfs by default)
+ */
+__attribute__((malloc)) static char* mk_scratch_dir(const char* name) {
+    check_scratch_root(true);
+    const char* scratch_root = get_scratch_root();
+
+    size_t scratch_dir_size = strlen(scratch_root) + strlen(name) + strlen("/.XXXXXX") + 1;
+    char* scratch_dir = (char*) malloc(scratch_dir_size);
+    snprintf(scratch_dir, scratch_dir_size, "%s/%s.XXXXXX", scratch_root, name);
+
+    if (mkdtemp(scratch_dir) == NULL) {
+        ERROR("ERROR: mkdtemp(): %s: ", scratch_dir);
+        perror(NULL);
+        exit(1);
+    }
+    return scratch_dir;
+}
+
+static void lock_registry(int fd, short type) {
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+    };
+    while (fcntl(fd, F_SETLKW, &lock) < 0 && errno == EINTR);
+}
+
+/*
+ * Records TARGET, the scratch dir, and LINK, the symlink pointing at it, for cg gc
+ */
+static bool scratch_register(const char* target, const char* link) {
+    check_scratch_root(true);
+    int fd = open_registry(O_WRONLY | O_CREAT | O_APPEND);
+    if (fd < 0) {
+        ERROR("ERROR: open(): %s/%s: ", get_scratch_root(), SCRATCH_REGISTRY);
+        perror(NULL);
+        return false;
+    }
+
+    lock_registry(fd, F_WRLCK);
+    dprintf(fd, "%ld\t%s\t%s\n", (long) time(NULL), target, link);
+    lock_registry(fd, F_UNLCK);
+    close(fd);
+    return true;
+}
+
+/*
+ * Parses AGE like 45s, 30m, 12h, 7d, 2w or plain seconds, returns -1 when invaild
+ */
+static long parse_age(const char* age) {
+    char* unit;
+    long value = strtol(age, &unit, 10);
+    if (unit == age || value < 0) {
+        return -1;
+    }
+
+    if (STRCMP(unit, "") || STRCMP(unit, "s")) return value;
+    if (STRCMP(unit, "m")) return value * 60;
+    if (STRCMP(unit, "h")) return value * 60 * 60;
+    if (STRCMP(unit, "d")) return value * 60 * 60 * 24;
+    if (STRCMP(unit, "w")) return value * 60 * 60 * 24 * 7;
+    return -1;
+}
+
+static time_t newest_mtime;
+
+static int newest_mtime_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw) {
+    if (flag != FTW_NS && sb->st_mtime > newest_mtime) {
+        newest_mtime = sb->st_mtime;
+    }
+    return 0;
+}
+
+/*
+ * Newest mtime of anything under PATH, editing a file deep in the tree does not touch the mtime of PATH
+ */
+static time_t get_newest_mtime(const char* path) {
+    newest_mtime = 0;
+    nftw(path, newest_mtime_entry, 64, FTW_PHYS);
+    return newest_mtime;
+}
+
+static int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw) {
+    return remove(path);
+}
+
+static bool remove_tree(const char* path) {
+    return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+static void unlink_if_points_to(const char* link, const char* target) {
+    char buffer[4096];
+    ssize_t size = readlink(link, buffer, sizeof(buffer) - 1);
+    if (size < 0) {
+        return;
+    }
+    buffer[size] = '\0';
+
+    if (STRCMP(buffer, target)) {
+        unlink(link);
+    }
+}
+
+#define GC_WORKER_REMOVED 0
+#define GC_WORKER_FAILED 1
+#define GC_WORKER_IN_USE 2
+
+typedef struct {
+    long created;
+    char* target;
+    char* link;
+    bool keep;
+} ScratchEntry;
+
+static void reap_worker(ScratchEntry* entries, pid_t* workers, size_t entries_len, size_t* removed, size_t* failed) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+        return;
+    }
+
+    size_t i = 0;
+    for (; i < entries_len && workers[i] != pid; ++i);
+    if (i == entries_len) {
+        return;
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == GC_WORKER_REMOVED) {
+        ++*removed;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == GC_WORKER_IN_USE) {
+        entries[i].keep = true;
+    } else {
+        entries[i].keep = true;   /* Retry on the next gc */
+        ++*failed;
+    }
+}
+
+/*
+ * Deletes registered scratch projects not touched for OLDER_THAN seconds, one worker per cpu
+ */
+static int scratch_gc(long older_than) {
+    int fd = check_scratch_root(false) ? open_registry(O_RDWR) : -1;
+    if (fd < 0) {
+        fprintf(stdout, "cg: Nothing to collect, %s/%s not found\n", get_scratch_root(), SCRATCH_REGISTRY);
+        return 0;
+    }
+
+    /* Any other descriptor of the registry closed by this process would drop the lock, read through fd only */
+    lock_registry(fd, F_WRLCK);
+
+    size_t size;
+    char* content = read_fd(fd, &size);
+
+    size_t entries_size = 0;
+    char* cursor = content;
+    for (; cursor != NULL && *cursor != '\0'; ++cursor) {
+        if (*cursor == '\n') ++entries_size;
+    }
+    ScratchEntry* entries = (ScratchEntry*) calloc(entries_size + 1, sizeof(ScratchEntry));
+    pid_t* workers = (pid_t*) calloc(entries_size + 1, sizeof(pid_t));
+
+    size_t entries_len = 0;
+    char* line = (content != NULL) ? strtok(content, "\n") : NULL;
+    for (; line != NULL; line = strtok(NULL, "\n")) {
+        char* target = strchr(line, '\t');
+        char* link = (target != NULL) ? strchr(target + 1, '\t') : NULL;
+        if (link == NULL) {
+            continue;   /* Skip malformed lines */
+        }
+        *target++ = '\0';
+        *link++ = '\0';
+
+        entries[entries_len++] = (ScratchEntry) {
+            .created = strtol(line, NULL, 10),
+            .target = target,
+            .link = link,
+        };
+    }
+
+    long max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_workers < 1) max_workers = 1;
+
+    long now = (long) time(NULL);
+    long running = 0;
+    size_t removed = 0, failed = 0;
+
+    size_t i = 0;
+    for (; i < entries_len; ++i) {
+        if (running >= max_workers) {
+            reap_worker(entries, workers, entries_len, &removed, &failed);
+            --running;
+        }
+
+        ScratchEntry* entry = &entries[i];
+
+        if (!is_scratch_target(entry->target)) {   /* Never follow the registry out of the scratch root */
+            ERROR("WARNING: Dropping %s from the registry, it is not under %s\n", entry->target, get_scratch_root());
+            continue;
+        }
+
+        struct stat _stat;
+        if (lstat(entry->target, &_stat) < 0) {   /* Gone already, e.g. tmpfs after a reboot */
+            unlink_if_points_to(entry->link, entry->target);
+            continue;
+        }
+
+        if (!S_ISDIR(_stat.st_mode) || _stat.st_uid != getuid()) {
+            ERROR("WARNING: Dropping %s from the registry, it is not a directory owned by you\n", entry->target);
+            continue;
+        }
+
+        if (now - entry->created < older_than) {
+            entry->keep = true;
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            entry->keep = true;
+            continue;
+        }
+
+        if (pid == 0) {
+            if (now - (long) get_newest_mtime(entry->target) < older_than) {
+                _exit(GC_WORKER_IN_USE);
+            }
+
+            if (!remove_tree(entry->target)) {
+                ERROR("ERROR: Removing %s: ", entry->target);
+                perror(NULL);
+                _exit(GC_WORKER_FAILED);
+            }
+            unlink_if_points_to(entry->link, entry->target);
+            _exit(GC_WORKER_REMOVED);
+        }
+
+        workers[i] = pid;
+        ++running;
+    }
+
+    for (; running > 0; --running) {
+        reap_worker(entries, workers, entries_len, &removed, &failed);
+    }
+
+    if (ftruncate(fd, 0) < 0) {
+        perror("ftruncate");
+    }
+    lseek(fd, 0, SEEK_SET);
+    for (i = 0; i < entries_len; ++i) {
+        if (entries[i].keep) {
+            dprintf(fd, "%ld\t%s\t%s\n", entries[i].created, entries[i].target, entries[i].link);
+        }
+    }
+
+    lock_registry(fd, F_UNLCK);
+    close(fd);
+
+    fprintf(stdout, "cg: Removed %zu scratch projects, %zu failed\n", removed, failed);
+
+    free(workers);
+    free(entries);
+    free(content);
+    return (failed == 0) ? 0 : 1;
+}
+
 /* -------------------------------------------------------------------------------------------- */
 static const char* help_message = "\
 Usage: %s [ARGS...] [OPTIONS...]\n\
@@ -488,6 +1527,11 @@ Description: Creates a temporary project\n\
 Args:\n\
     new    Creates new project dir\n\
     init   Iniitializes new project in current dir\n\
+    add    Adds missing test, bench dirs to the project in current dir, existing files are left untouched\n\
+           e.g. %s add +test +bench\n\
+    status [DIR]  Shows the state of the --preconfigure job, exits 0 when done, 2 while running\n\
+    gc [--older-than AGE]\n\
+           Deletes --scratch projects where nothing was modified for AGE (30m, 12h, 7d, ...), default is 7d\n\
 \n\
 Options:\n\
     -a, --add [test|bench]   generate test, benchmark dirs [test, bench]\n\
@@ -501,12 +1545,21 @@ Options:\n\
     -ac, --add-libcheck      Use libcheck for testing\n\
 \n\
     -cc, --c-files           Generates c files\n\
+\n\
+    -be, --bench-env         With +bench, generate bench_env which checks cpu governor, turbo, smt, isolated cpus,\n\
+                             load and aslr, and a bench_pinned target running bench on fixed cpus\n\
+\n\
+    -s, --scratch            With new, -r create the project on tmpfs and symlink it here,\n\
+                             with init, add put build/ on tmpfs. Defaults to $XDG_RUNTIME_DIR/cg or /dev/shm/cg-UID,\n\
+                             set $CG_SCRATCH_DIR to use another dir\n\
+\n\
+    -p, --preconfigure       Configure build/ and build the test, bench dependencies in background\n\
 \n\
     -h, --help               shows help message\n\
 ";
 
 static void Usage(FILE* where) {
-    fprintf(where, help_message, EXECUTABLE);
+    fprintf(where, help_message, EXECUTABLE, EXECUTABLE);
 }
 
 int main(int argc, char** argv) {
@@ -521,6 +1574,7 @@ int main(int argc, char** argv) {
     make_config(&config);
 
     Args args;
+    mk_args(&args);
 
     Flags flags;
     mk_flags(&flags);
@@ -548,6 +1602,37 @@ int main(int argc, char** argv) {
             mk_config_name_init(&config);
             args.init = true;
             args_begin += 1;
+        } else if (STRCMP(*args_begin, "add")) {
+            mk_config_name_init(&config);
+            args.add = true;
+            args_begin += 1;
+            if (args_begin != args_end && *args_begin[0] == '+') {
+                args_begin = parse_add_list(args_begin, args_end, &flags);
+            }
+        } else if (STRCMP(*args_begin, "status")) {
+            char** curr = args_begin + 1;
+            const char* directory = (curr != args_end) ? *curr : get_curr_path();
+            exit(preconfigure_report(directory));
+        } else if (STRCMP(*args_begin, "gc")) {
+            const char* age = SCRATCH_GC_DEFAULT_AGE;
+            char** curr = args_begin + 1;
+            if (curr != args_end && STRCMP(*curr, "--older-than")) {
+                if (curr + 1 == args_end) {
+                    ERROR("ERROR: missing AGE\n");
+                    CG_PANIC(&config);
+                }
+                age = *(curr + 1);
+            } else if (curr != args_end) {
+                ERROR("NO MATCH: %s\n", *curr);
+                CG_PANIC(&config);
+            }
+
+            long older_than = parse_age(age);
+            if (older_than < 0) {
+                ERROR("ERROR: Invaild %s, requires something like 30m, 12h, 7d\n", age);
+                CG_PANIC(&config);
+            }
+            exit(scratch_gc(older_than));
         } else if (STRCMP(*args_begin, "-a") || STRCMP(*args_begin, "--add")) {
             char** curr = args_begin + 1;
             if (curr == args_end) {
@@ -555,34 +1640,7 @@ int main(int argc, char** argv) {
                 Usage(stderr);
                 exit(1);
             } else {
-                size_t max_args_len = 2;
-                char** list_args_begin = curr;
-                char** list_args_end = (curr + 1 != args_end) ? (list_args_begin + max_args_len) : (args_end);
-                
-                if (*list_args_begin[0] != '+') { /* Check first arg */
-                    ERROR("ERROR: Invaild %s\n", *list_args_begin);
-                    Usage(stderr);
-                    exit(1);
-                }
-
-                while(list_args_begin != list_args_end) {
-                    if (*list_args_begin[0] != '+') {
-                        goto CONTINUE_PARSE;
-                    }
-
-                    if (STRCMP(*list_args_begin, "+test")) {
-                        flags.test = true;
-                    } else if (STRCMP(*list_args_begin, "+bench")) {
-                        flags.benchmark = true;
-                    } else {
-                        ERROR("ERROR: Invaild %s\n", *list_args_begin);
-                        Usage(stderr);
-                        exit(1);
-                    }
-                    list_args_begin++;
-                }
-CONTINUE_PARSE:
-                args_begin = list_args_begin;
+                args_begin = parse_add_list(curr, args_end, &flags);
             }
         } else if (STRCMP(*args_begin, "-r") || STRCMP(*args_begin, "--random-dir")) {
             if (args.new) {            /*Raise an error if new is supplied as well*/
@@ -627,6 +1685,15 @@ CONTINUE_PARSE:
         } else if (STRCMP(*args_begin, "-cc") || STRCMP(*args_begin, "--c-files")) {
             flags.make_c_files = true;
             args_begin++;
+        } else if (STRCMP(*args_begin, "-be") || STRCMP(*args_begin, "--bench-env")) {
+            flags.bench_env = true;
+            args_begin++;
+        } else if (STRCMP(*args_begin, "-s") || STRCMP(*args_begin, "--scratch")) {
+            flags.scratch = true;
+            args_begin++;
+        } else if (STRCMP(*args_begin, "-p") || STRCMP(*args_begin, "--preconfigure")) {
+            flags.preconfigure = true;
+            args_begin++;
         } else if (STRCMP(*args_begin, "-h") || STRCMP(*args_begin, "--help")) {
             Usage(stdout);
             exit(0);
@@ -637,11 +1704,31 @@ CONTINUE_PARSE:
         }
     }
 
-    if (!args.new && !args.init) {
-        ERROR("ERROR: Missing positional args %s, %s\n", "init", "new");
+    if (!args.new && !args.init && !args.add) {
+        ERROR("ERROR: Missing positional args %s, %s, %s\n", "init", "new", "add");
         exit(1);
     }
 
+    if (args.add && (args.new || args.init)) {
+        ERROR("ERROR: Invaild use of add with new, init or --random-dir\n");
+        CG_PANIC(&config);
+    }
+
+    if (args.add && (!IS_ADD_SUPPLIED || flags.make_c_files)) {
+        ERROR("ERROR: add requires +test or +bench\n");
+        CG_PANIC(&config);
+    }
+
+    if (flags.bench_env && !flags.benchmark) {
+        ERROR("ERROR: --bench-env requires +bench\n");
+        CG_PANIC(&config);
+    }
+
+    if (flags.preconfigure && flags.make_c_files) {
+        ERROR("ERROR: Invaild use of --preconfigure with --c-files\n");
+        CG_PANIC(&config);
+    }
+
     if (flags.sprinkle_w_numerics) {
         sprinkle_path_w_numerics(config.name, strlen(config.name));
     }
@@ -661,10 +1748,38 @@ CONTINUE_PARSE:
         CG_PANIC(&config);
     }
 
-    if (!args.init) {
+    if (args.add) {
+        char* root_cmakelists_path = append_path(config.path, "CMakeLists.txt");
+        if (!file_exists(root_cmakelists_path)) {
+            ERROR("ERROR: %s not found, add works on existing projects\n", root_cmakelists_path);
+            free(root_cmakelists_path);
+            CG_PANIC(&config);
+        }
+        free(root_cmakelists_path);
+    }
+
+    if (args.new && flags.scratch) {
+        /* Registered first, an entry whose link never got created is dropped by gc once the dir is gone */
+        char* directory_scratch = mk_scratch_dir(config.name);
+        if (!scratch_register(directory_scratch, config.path)) {
+            rmdir(directory_scratch);
+            exit(1);
+        }
+        if (symlink(directory_scratch, config.directory) < 0) {
+            ERROR("ERROR: symlink(): %s: ", config.directory);
+            perror(NULL);
+            rmdir(directory_scratch);
+            exit(1);
+        }
+        free(directory_scratch);
+
+        if (flags.initialize_git_repo) {
+            CG_SWITCH_DIRECTORY_A_EXEC(config.path, GIT_INIT);
+        }
+    } else if (args.new) {
         CG_MKDIR_W_GIT(config.directory, flags.initialize_git_repo);
     } else {
-        if (flags.initialize_git_repo) {
+        if (flags.initialize_git_repo && !exists(".git")) {
             CG_SYSTEM(GIT_INIT);
         }
     }
@@ -673,6 +1788,8 @@ CONTINUE_PARSE:
     /* Create directories and files                                                                 */
     /* -------------------------------------------------------------------------------------------- */
 
+    char preconfigure_targets[64] = "";
+
     if (flags.make_c_files) {
         CG_WRITE(cg_file_write, config.path, "main.c", "/*%s*/\n", config.name);
         CG_WRITE(cg_file_append, config.path, "main.c", source_main);
@@ -680,53 +1797,90 @@ CONTINUE_PARSE:
         goto DONE;
     }
 
+    if (!args.new && flags.scratch) {
+        char* directory_build = append_path(config.path, PRECONFIGURE_BUILD_DIR);
+        struct stat _stat;
+
+        if (lstat(directory_build, &_stat) < 0) {
+            char* directory_scratch = mk_scratch_dir(config.name);
+            if (!scratch_register(directory_scratch, directory_build)) {
+                rmdir(directory_scratch);
+                exit(1);
+            }
+            if (symlink(directory_scratch, directory_build) < 0) {
+                ERROR("ERROR: symlink(): %s: ", directory_build);
+                perror(NULL);
+                rmdir(directory_scratch);
+                exit(1);
+            }
+            free(directory_scratch);
+        } else if (!S_ISLNK(_stat.st_mode)) {
+            ERROR("WARNING: %s already exists, leaving it on disk\n", directory_build);
+        }
+        free(directory_build);
+    }
+
+    /*
+     * Existing files belong to the user and are never rewritten, so re-running init or add keeps
+     * build trees warm. CMakeLists.txt files are only patched through cmake_append_once
+     */
     DirRoot Dir_Root = mk_dir_root(root_cmakelists, root_gitignore);
     char* directory_root = config.path;
 
-    WRITE(directory_root, "CMakeLists.txt", Dir_Root.cmakelists);
-    
+    WRITE_CREATE(directory_root, "CMakeLists.txt", Dir_Root.cmakelists);
+
     if (flags.initialize_git_repo) {
-        WRITE(directory_root, ".gitignore", Dir_Root.gitignore);
+        WRITE_CREATE(directory_root, ".gitignore", Dir_Root.gitignore);
     }
 
     DirSource Dir_Source = mk_dir_source(source_main, source_cmakelists);
     char* directory_source = append_path(config.path, "src");
-    MKDIR_OR_PANIC(&config, directory_source);
+    MKDIR_IF_MISSING_OR_PANIC(&config, directory_source);
 
-    WRITE(directory_source, "main.cpp", Dir_Source.main);
-    WRITE(directory_source, "CMakeLists.txt", Dir_Source.cmakelists);
+    WRITE_CREATE(directory_source, "main.cpp", Dir_Source.main);
+    WRITE_CREATE(directory_source, "CMakeLists.txt", Dir_Source.cmakelists);
     free(directory_source);
 
+    char* directory_test = append_path(config.path, "test");
+    bool has_test = flags.test || exists(directory_test);
+
+    /* bench without test vendors the test framework, test/CMakeLists.txt then reuses its targets */
+    char* directory_vendored = v_append_path(config.path, "vendor", flags.add_libcheck ? "check" : "googletest", NULL);
+    bool has_vendored = exists(directory_vendored);
+    free(directory_vendored);
+
     if (flags.test) {
-        const char* directory_test = append_path(config.path, "test");
-        MKDIR_OR_PANIC(&config, directory_test);
+        MKDIR_IF_MISSING_OR_PANIC(&config, directory_test);
 
-        WRITE_APPEND(directory_root, "CMakeLists.txt", "add_subdirectory(test)\n");
+        /* enable_testing() has to precede add_subdirectory(test) for ctest to see the tests from the root */
+        cmake_insert_once(directory_root, "enable_testing()", "add_subdirectory(test)", "enable_testing()\n");
+        cmake_add_subdirectory(directory_root, "test");
 
         if (flags.add_libcheck) {
             DirTest Dir_Test = mk_dir_test(test_test_libcheck, test_cmakelists_libcheck);
-            WRITE(directory_test, "test.c", Dir_Test.test);
-            WRITE(directory_test, "CMakeLists.txt", Dir_Test.cmakelists);
+            WRITE_CREATE(directory_test, "test.c", Dir_Test.test);
+            WRITE_CREATE(directory_test, "CMakeLists.txt", Dir_Test.cmakelists);
         } else {
             DirTest Dir_Test = mk_dir_test(test_test_gtest, test_cmakelists_gtest);
-            WRITE(directory_test, "test.cpp", Dir_Test.test);
-            WRITE(directory_test, "CMakeLists.txt", Dir_Test.cmakelists);
+            WRITE_CREATE(directory_test, "test.cpp", Dir_Test.test);
+            WRITE_CREATE(directory_test, "CMakeLists.txt", Dir_Test.cmakelists);
         }
 
-        CG_ADD_SUBMODULE(directory_test, config.test_repository);
-
-        free(directory_test);
+        if (!has_vendored) {
+            CG_ADD_SUBMODULE(directory_test, config.test_repository);
+        }
     }
+    free(directory_test);
 
     if (flags.benchmark) {
-        if (!flags.test) {
-            const char* directory_vendor = append_path(config.path, "vendor");
-            MKDIR_OR_PANIC(&config, directory_vendor);
+        if (!has_test) {
+            char* directory_vendor = append_path(config.path, "vendor");
+            MKDIR_IF_MISSING_OR_PANIC(&config, directory_vendor);
 
             if (flags.add_libcheck) {
-                WRITE_APPEND(directory_root, "CMakeLists.txt", "add_subdirectory(vendor/check)\n");
+                cmake_add_subdirectory(directory_root, "vendor/check");
             } else {
-                WRITE_APPEND(directory_root, "CMakeLists.txt", "add_subdirectory(vendor/googletest)\n");
+                cmake_add_subdirectory(directory_root, "vendor/googletest");
             }
 
             CG_ADD_SUBMODULE(directory_vendor, config.test_repository);
@@ -735,22 +1889,41 @@ CONTINUE_PARSE:
         }
 
         DirBenchmark Dir_Benchmark = mk_dir_benchmark(benchmark_bench, benchmark_cmakelists);
-        const char* directory_benchmark = append_path(config.path, "benchmark");
-        MKDIR_OR_PANIC(&config, directory_benchmark);
+        char* directory_benchmark = append_path(config.path, "benchmark");
+        MKDIR_IF_MISSING_OR_PANIC(&config, directory_benchmark);
+
+        cmake_add_subdirectory(directory_root, "benchmark");
+        WRITE_CREATE(directory_benchmark, "bench.cpp", Dir_Benchmark.bench);
+        WRITE_CREATE(directory_benchmark, "CMakeLists.txt", Dir_Benchmark.cmakelists);
 
-        WRITE_APPEND(directory_root, "CMakeLists.txt", "add_subdirectory(benchmark)\n");
-        WRITE(directory_benchmark, "bench.cpp", Dir_Benchmark.bench);
-        WRITE(directory_benchmark, "CMakeLists.txt", Dir_Benchmark.cmakelists);
+        if (flags.bench_env) {
+            CG_WRITE(cg_file_create, directory_benchmark, "bench_env.cpp", "%s", benchmark_bench_env);
+            cmake_append_once(directory_benchmark, "add_executable(bench_env", benchmark_cmakelists_bench_env);
+        }
 
         CG_ADD_SUBMODULE(directory_benchmark, REPOSITORY_GOOGLE_BENCHMARK);
 
         free(directory_benchmark);
     }
 
+    if (has_test || flags.benchmark) {
+        strcat(preconfigure_targets, flags.add_libcheck ? " check" : " gtest gtest_main");
+    }
+    char* directory_benchmark = append_path(config.path, "benchmark");
+    if (flags.benchmark || exists(directory_benchmark)) {
+        strcat(preconfigure_targets, " benchmark");
+    }
+    free(directory_benchmark);
+
     goto DONE;
 
 DONE:
-    fprintf(stdout, "cg: Created %s\n", config.directory);
+    fprintf(stdout, "cg: %s %s\n", args.add ? "Updated" : "Created", config.directory);
+
+    if (flags.preconfigure) {
+        preconfigure(&config, preconfigure_targets[0] != '\0' ? preconfigure_targets + 1 : NULL);
+    }
+
     wreck_config(&config);
     return 0;
 }